@@ -1,5 +1,10 @@
 #include "collide.hpp"
 
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
 #include <boost/make_shared.hpp>
 #include <boost/assign.hpp>
 
@@ -134,54 +139,70 @@ void Marble::setVelocity(Date t, Velocity v) {
     _v = v;
 }
 
-namespace collisions {
-    boost::optional<Date> nextCollisionDate(const Date& after, const Marble& m1, const Marble& m2) {
-        boost::optional<Date> t = collisionDate(m1, m2);
-        if(t && *t > after) {
-            return t;
+namespace {
+    // Duration until a point, at d from the center of a circle of radius r and moving at v relatively to it, enters this circle
+    boost::optional<Duration> enteringDuration(const Displacement& d, const Velocity& v, float r) {
+        // Entering at dt (to be solved for dt)
+        // <=> (d + v * dt).length() == r
+        // <=> (d.dx + v.vx * dt)² + (d.dy + v.vy * dt)² == r²
+        // <=> (d.dx² + 2 * d.dx * v.vx * dt + v.vx² * dt²) + (d.dy² + 2 * d.dy * v.vy * dt + v.vy² * dt²) == r²
+        // <=> (v.vx² + v.vy²) * dt² + 2 * (d.dx * v.vx + d.dy * v.vy) * dt + (d.dx² + d.dy² - r²) == 0
+        float b = d.dx * v.vx + d.dy * v.vy;
+        // Cheap rejection first: when b >= 0, the point is not getting closer to the center.
+        // This includes a == 0, when the point doesn't move relatively to the circle.
+        if(b >= 0) {
+            return boost::optional<Duration>();
         }
-        return boost::optional<Date>();
-    }
-
-    boost::optional<Date> collisionDate(const Marble& m1, const Marble& m2) {
-        // Collision at t (to be solved for t)
-        // <=> (m1.p(t) - m2.p(t)).length() == m1.r() + m2.r()
-        // <=> ((m1.p(0) + m1.v() * t) - (m2.p(0) + m2.v() * t)).length2() == (m1.r() + m2.r())²
-        float r2 = (m1.r() + m2.r()) * (m1.r() + m2.r());
-        // <=>   ((m1.p(0).x + m1.v().vx * t) - (m2.p(0).x + m2.v().vx * t))²
-        //     + ((m1.p(0).y + m1.v().vy * t) - (m2.p(0).y + m2.v().vy * t))²
-        //     == r2
-        // <=>   ((m1.p(0).x - m2.p(0).x) + (m1.v().vx - m2.v().vx) * t)²
-        //     + ((m1.p(0).y - m2.p(0).y) + (m1.v().vy - m2.v().vy) * t)²
-        //     == r2
-        float dx = m1.p(0).x - m2.p(0).x;
-        float dy = m1.p(0).y - m2.p(0).y;
-        float dvx = m1.v().vx - m2.v().vx;
-        float dvy = m1.v().vy - m2.v().vy;
-        // <=> (dx + dvx * t)² + (dy + dvy * t)² == r2
-        // <=> (dx² + 2 * dx * dvx * t + dvx² * t²) + (dy² + 2 * dy * dvy * t + dvy² * t²) == r2
-        // <=> (dvx² + dvy²) * t² + 2 * (dx * dvx + dy * dvy) * t + (dx² + dy² - r2) == 0
-        float a = dvx * dvx + dvy * dvy;
-        float b = dx * dvx + dy * dvy;
-        float c = dx * dx + dy * dy - r2;
-        // <=> a * t² + 2 * b * t + c == 0
+        float a = v.vx * v.vx + v.vy * v.vy;
+        float c = d.length2() - r * r;
+        // <=> a * dt² + 2 * b * dt + c == 0
 
         // Some properties of this parabol:
-        //  - it's concav (decreasing first then increasing) because two constant-velocity objects first get closer to each other, then get further.
+        //  - it's concav (decreasing first then increasing) because the distance between two constant-velocity objects first decreases, then increases.
         //    Also, this is proven by the fact that a is a sum of squares, hence positive or null.
-        assert(a >= 0);
-        //  - it degenerates to an horizontal line when m1.v() == m2.v(), meaning that two objects with same velocity have a constant distance between them.
-        //    This is consistent with a being the norm of m1.v() - m2.v(), null in that case.
-        //    And if a == 0, then dvx == 0 and dvy == 0, so b == 0 too: two objects with same velocity never collide (unless they always touch each other, which we don't model)
-
-        if(a != 0) {
-            float delta = b * b - a * c;
-            if(delta >= 0) {
-                // a > 0 so we know which root is smaller.
-                // This is the only root we're interrested in, because the other one corresponds to when marbles "touch" after intersecting
-                return Date((-b - sqrt(delta)) / a);
+        //  - a > 0 here (b < 0 implies v is not null), so we know which root is smaller.
+        //    This is the only root we're interrested in, because the other one corresponds to when the point leaves the circle
+        float delta = b * b - a * c;
+        if(delta >= 0) {
+            float dt = (-b - sqrt(delta)) / a;
+            if(dt > 0) {
+                return Duration(dt);
             }
         }
+        return boost::optional<Duration>();
+    }
+
+    Displacement unit(const Displacement& d) {
+        return d / d.length();
+    }
+
+    float dot(const Displacement& d, const Velocity& v) {
+        return d.dx * v.vx + d.dy * v.vy;
+    }
+
+    float dot(const Displacement& a, const Displacement& b) {
+        return a.dx * b.dx + a.dy * b.dy;
+    }
+}
+
+
+namespace collisions {
+    boost::optional<Date> nextCollisionDate(const Date& after, const Marble& m1, const Marble& m2, const boost::optional<Duration>& horizon) {
+        // Relatively to after, to avoid extrapolating the trajectories back to t=0
+        Displacement d = m1.p(after) - m2.p(after);
+        Velocity dv = m1.v() - m2.v();
+        float r = m1.r() + m2.r();
+        if(horizon) {
+            // The distance between the marbles can't decrease faster than their relative speed
+            float reach = r + std::sqrt(dv.vx * dv.vx + dv.vy * dv.vy) * horizon->dt;
+            if(d.length2() > reach * reach) {
+                return boost::optional<Date>();
+            }
+        }
+        boost::optional<Duration> dt = enteringDuration(d, dv, r);
+        if(dt && (!horizon || !(dt->dt > horizon->dt))) {
+            return after + *dt;
+        }
         return boost::optional<Date>();
     }
 
@@ -210,20 +231,305 @@ namespace collisions {
 }
 
 
+Peg::Peg(Position center, float r) :
+    _center(center),
+    _r(r)
+{
+}
+
+Position Peg::center() const {
+    return _center;
+}
+
+float Peg::r() const {
+    return _r;
+}
+
+Position Peg::min() const {
+    return Position(_center.x - _r, _center.y - _r);
+}
+
+Position Peg::max() const {
+    return Position(_center.x + _r, _center.y + _r);
+}
+
+boost::optional<Date> Peg::nextCollisionDate(const Date& after, const Marble& m) const {
+    boost::optional<Duration> dt = enteringDuration(m.p(after) - _center, m.v(), m.r() + _r);
+    if(dt) {
+        return after + *dt;
+    }
+    return boost::optional<Date>();
+}
+
+Displacement Peg::normal(const Date& t, const Marble& m) const {
+    return unit(m.p(t) - _center);
+}
+
+
+Segment::Segment(Position a, Position b) :
+    _a(a),
+    _b(b)
+{
+    if((_b - _a).length2() == 0) {
+        throw std::invalid_argument("Segment ends must be different");
+    }
+}
+
+Position Segment::a() const {
+    return _a;
+}
+
+Position Segment::b() const {
+    return _b;
+}
+
+Position Segment::min() const {
+    return Position(std::min(_a.x, _b.x), std::min(_a.y, _b.y));
+}
+
+Position Segment::max() const {
+    return Position(std::max(_a.x, _b.x), std::max(_a.y, _b.y));
+}
+
+boost::optional<Date> Segment::nextCollisionDate(const Date& after, const Marble& m) const {
+    float length = (_b - _a).length();
+    Displacement u = (_b - _a) / length;
+    Displacement n(-u.dy, u.dx);
+    Displacement ap = m.p(after) - _a;
+
+    // Collision with the inside of the segment: the distance to the line decreases to r
+    float distance = dot(ap, n);
+    float vn = dot(n, m.v());
+    if(distance * vn < 0 && std::abs(distance) > m.r()) {
+        Duration dt((std::abs(distance) - m.r()) / std::abs(vn));
+        float along = dot(Displacement(ap.dx + m.v().vx * dt.dt, ap.dy + m.v().vy * dt.dt), u);
+        if(along >= 0 && along <= length) {
+            return after + dt;
+        }
+    }
+
+    // Collision with an end of the segment. It can't happen before a collision with the inside.
+    boost::optional<Duration> dt;
+    for(Position e: {_a, _b}) {
+        boost::optional<Duration> dte = enteringDuration(m.p(after) - e, m.v(), m.r());
+        if(dte && (!dt || dte->dt < dt->dt)) {
+            dt = dte;
+        }
+    }
+    if(dt) {
+        return after + *dt;
+    }
+    return boost::optional<Date>();
+}
+
+Displacement Segment::normal(const Date& t, const Marble& m) const {
+    float length = (_b - _a).length();
+    Displacement u = (_b - _a) / length;
+    float along = std::max(0.f, std::min(length, dot(m.p(t) - _a, u)));
+    return unit(m.p(t) - (_a + along * u));
+}
+
+
+ObstaclesGrid::ObstaclesGrid(float width, float height, float cellSize, const std::vector<boost::shared_ptr<Obstacle>>& obstacles) :
+    _cellSize(cellSize),
+    _columns(std::max(1, int(std::ceil(width / cellSize)))),
+    _rows(std::max(1, int(std::ceil(height / cellSize)))),
+    _obstacles(obstacles),
+    _cells(_columns * _rows),
+    _visits(obstacles.size(), 0),
+    _visit(0)
+{
+    for(std::size_t i = 0; i != _obstacles.size(); ++i) {
+        if(const Segment* segment = dynamic_cast<const Segment*>(_obstacles[i].get())) {
+            // A long diagonal segment would cover many cells with its bounding box
+            insert(i, *segment);
+        } else {
+            for(int x = column(_obstacles[i]->min().x); x <= column(_obstacles[i]->max().x); ++x) {
+                for(int y = row(_obstacles[i]->min().y); y <= row(_obstacles[i]->max().y); ++y) {
+                    insert(i, x, y);
+                }
+            }
+        }
+    }
+}
+
+void ObstaclesGrid::insert(std::size_t obstacle, int x, int y) {
+    if(x >= 0 && x < _columns && y >= 0 && y < _rows) {
+        _cells[y * _columns + x].push_back(obstacle);
+    }
+}
+
+void ObstaclesGrid::insert(std::size_t obstacle, const Segment& segment) {
+    // Same walk as in nextCollision, from a (at s=0) to b (at s=1), in cells possibly outside the grid
+    Position a = segment.a();
+    Displacement d = segment.b() - a;
+    int x = int(std::floor(a.x / _cellSize));
+    int y = int(std::floor(a.y / _cellSize));
+    const int endX = int(std::floor(segment.b().x / _cellSize));
+    const int endY = int(std::floor(segment.b().y / _cellSize));
+    const float infinity = std::numeric_limits<float>::infinity();
+    int stepX = d.dx > 0 ? 1 : -1;
+    int stepY = d.dy > 0 ? 1 : -1;
+    float nextX = d.dx == 0 ? infinity : ((x + (d.dx > 0)) * _cellSize - a.x) / d.dx;
+    float nextY = d.dy == 0 ? infinity : ((y + (d.dy > 0)) * _cellSize - a.y) / d.dy;
+    float deltaX = d.dx == 0 ? infinity : _cellSize / std::abs(d.dx);
+    float deltaY = d.dy == 0 ? infinity : _cellSize / std::abs(d.dy);
+    while(true) {
+        insert(obstacle, x, y);
+        if((x == endX && y == endY) || std::min(nextX, nextY) > 1) {
+            break;
+        }
+        if(std::abs(nextX - nextY) < 1e-6) {
+            // Through a corner: also insert in both neighbours, in case of rounding errors
+            insert(obstacle, x + stepX, y);
+            insert(obstacle, x, y + stepY);
+            x += stepX;
+            y += stepY;
+            nextX += deltaX;
+            nextY += deltaY;
+        } else if(nextX < nextY) {
+            x += stepX;
+            nextX += deltaX;
+        } else {
+            y += stepY;
+            nextY += deltaY;
+        }
+    }
+}
+
+const std::vector<boost::shared_ptr<Obstacle>>& ObstaclesGrid::obstacles() const {
+    return _obstacles;
+}
+
+int ObstaclesGrid::column(float x) const {
+    return std::max(0, std::min(_columns - 1, int(std::floor(x / _cellSize))));
+}
+
+int ObstaclesGrid::row(float y) const {
+    return std::max(0, std::min(_rows - 1, int(std::floor(y / _cellSize))));
+}
+
+boost::optional<std::pair<Date, boost::shared_ptr<Obstacle>>> ObstaclesGrid::nextCollision(const Date& after, const Marble& m, const Date& before) const {
+    boost::optional<std::pair<Date, boost::shared_ptr<Obstacle>>> next;
+    Velocity v = m.v();
+    if(_obstacles.empty() || (v.vx == 0 && v.vy == 0)) {
+        return next;
+    }
+    ++_visit;
+
+    // Walk the cells crossed by the center of the marble (Amanatides & Woo),
+    // testing the obstacles in cells closer than its radius.
+    Position p = m.p(after);
+    int x = column(p.x);
+    int y = row(p.y);
+    const float infinity = std::numeric_limits<float>::infinity();
+    int stepX = v.vx > 0 ? 1 : -1;
+    int stepY = v.vy > 0 ? 1 : -1;
+    float nextX = v.vx == 0 ? infinity : ((x + (v.vx > 0)) * _cellSize - p.x) / v.vx;
+    float nextY = v.vy == 0 ? infinity : ((y + (v.vy > 0)) * _cellSize - p.y) / v.vy;
+    float deltaX = v.vx == 0 ? infinity : _cellSize / std::abs(v.vx);
+    float deltaY = v.vy == 0 ? infinity : _cellSize / std::abs(v.vy);
+    int k = int(std::ceil(m.r() / _cellSize));
+    Date entered = after;
+
+    while(entered < before && !(next && next->first < entered)) {
+        for(int i = std::max(0, x - k); i <= std::min(_columns - 1, x + k); ++i) {
+            for(int j = std::max(0, y - k); j <= std::min(_rows - 1, y + k); ++j) {
+                for(std::size_t o: _cells[j * _columns + i]) {
+                    if(_visits[o] != _visit) {
+                        _visits[o] = _visit;
+                        boost::optional<Date> t = _obstacles[o]->nextCollisionDate(after, m);
+                        if(t && *t < before && (!next || *t < next->first)) {
+                            next = std::make_pair(*t, _obstacles[o]);
+                        }
+                    }
+                }
+            }
+        }
+        if(nextX < nextY) {
+            x += stepX;
+            entered = after + Duration(nextX);
+            nextX += deltaX;
+        } else {
+            y += stepY;
+            entered = after + Duration(nextY);
+            nextY += deltaY;
+        }
+        if(x < 0 || x >= _columns || y < 0 || y >= _rows) {
+            break;
+        }
+    }
+    return next;
+}
+
+
 Simulation::Simulation(float width, float height, const std::vector<boost::shared_ptr<Marble>>& marbles) :
+    Simulation(width, height, marbles, std::vector<boost::shared_ptr<Obstacle>>())
+{
+}
+
+Simulation::Simulation(float width, float height, const std::vector<boost::shared_ptr<Marble>>& marbles, const std::vector<boost::shared_ptr<Obstacle>>& obstacles, float cellSize) :
     _w(width),
     _h(height),
     _marbles(marbles),
+    _obstacles(width, height, cellSize, obstacles),
+    _horizon(),
+    _started(false),
     _t(0),
+    _appliedEvents(0),
+    _listeners(),
+    _initial(),
+    _initialMomentumNorm(0),
+    _current(),
+    _impulseX(0),
+    _impulseY(0),
+    _driftAlarm(),
+    _driftAlarmRaised(false),
     _events()
 {
-    scheduleInitialEvents();
+    for(boost::shared_ptr<Marble> m: _marbles) {
+        _initial.add(*m, 1);
+        _initialMomentumNorm += m->m() * std::sqrt(double(m->v().vx) * m->v().vx + double(m->v().vy) * m->v().vy);
+    }
+    _current = _initial;
+}
+
+void Simulation::Totals::add(const Marble& m, double sign) {
+    double vx = m.v().vx;
+    double vy = m.v().vy;
+    energy += sign * m.m() * (vx * vx + vy * vy) / 2;
+    px += sign * m.m() * vx;
+    py += sign * m.m() * vy;
 }
 
 Date Simulation::t() const {
     return _t;
 }
 
+std::size_t Simulation::appliedEvents() const {
+    return _appliedEvents;
+}
+
+Simulation::Stats Simulation::stats() const {
+    Stats stats;
+    stats.appliedEvents = _appliedEvents;
+    stats.energy = _current.energy;
+    stats.energyDrift = _initial.energy == 0 ? 0 : std::abs(_current.energy - _initial.energy) / _initial.energy;
+    double dx = _current.px - _impulseX - _initial.px;
+    double dy = _current.py - _impulseY - _initial.py;
+    stats.momentumDrift = _initialMomentumNorm == 0 ? 0 : std::sqrt(dx * dx + dy * dy) / _initialMomentumNorm;
+    return stats;
+}
+
+void Simulation::setHorizon(const Duration& horizon) {
+    _horizon = horizon;
+}
+
+void Simulation::setDriftAlarm(double threshold) {
+    _driftAlarm = threshold;
+    _driftAlarmRaised = false;
+}
+
 float Simulation::width() const {
     return _w;
 }
@@ -236,13 +542,25 @@ const std::vector<boost::shared_ptr<Marble>>& Simulation::marbles() const {
     return _marbles;
 }
 
+const std::vector<boost::shared_ptr<Obstacle>>& Simulation::obstacles() const {
+    return _obstacles.obstacles();
+}
+
+void Simulation::addListener(boost::shared_ptr<Listener> listener) {
+    _listeners.push_back(listener);
+}
 
 void Simulation::runUntil(const Date& t) {
+    if(!_started) {
+        scheduleInitialEvents();
+        _started = true;
+    }
     while(!_events.empty() && _events.top()->t() < t) {
         auto e = _events.top();
+        // Pop before applying: the events scheduled by e could take its place at the top
+        _events.pop();
         _t = e->t();
         e->apply(*this);
-        _events.pop();
     }
     _t = t;
 }
@@ -264,8 +582,40 @@ void Simulation::Event::apply(Simulation& s) {
             return;
         }
     }
+    if(!changesTrajectories()) {
+        doApply(s);
+        return;
+    }
+    Totals delta;
+    for(ImpactedMarble m: _marbles) {
+        delta.add(*m.marble, -1);
+    }
     doApply(s);
     for(ImpactedMarble m: _marbles) {
+        delta.add(*m.marble, 1);
+    }
+    s._current.energy += delta.energy;
+    s._current.px += delta.px;
+    s._current.py += delta.py;
+    if(!conservesMomentum()) {
+        s._impulseX += delta.px;
+        s._impulseY += delta.py;
+    }
+    ++s._appliedEvents;
+    if(s._driftAlarm) {
+        Stats stats = s.stats();
+        bool exceeded = stats.energyDrift > *s._driftAlarm || stats.momentumDrift > *s._driftAlarm;
+        if(exceeded && !s._driftAlarmRaised) {
+            for(boost::shared_ptr<Listener> l: s._listeners) {
+                l->driftExceeded(_t, stats);
+            }
+        }
+        s._driftAlarmRaised = exceeded;
+    }
+    for(ImpactedMarble m: _marbles) {
+        for(boost::shared_ptr<Listener> l: s._listeners) {
+            l->trajectoryChanged(_t, *m.marble);
+        }
         s.scheduleNextEvents(m.marble);
     }
 }
@@ -279,9 +629,15 @@ public:
     {}
 
 public:
-    void doApply(Simulation&) {
+    void doApply(Simulation& s) {
         DEBUG("Executing collision between " << _m1->name() << " and " << _m2->name() << " at t=" << t().t);
         collisions::performCollision(t(), *_m1, *_m2);
+        if(!s._listeners.empty()) {
+            float speed = std::abs(dot(unit(_m2->p(t()) - _m1->p(t())), _m1->v() - _m2->v()));
+            for(boost::shared_ptr<Listener> l: s._listeners) {
+                l->marblesCollided(t(), *_m1, *_m2, speed);
+            }
+        }
     }
 
 private:
@@ -299,67 +655,184 @@ public:
     {}
 
 public:
-    void doApply(Simulation&) {
+    void doApply(Simulation& s) {
         DEBUG("Executing collision between " << _m->name() << " and wall at t=" << t().t);
         float vx = _m->v().vx;
         float vy = _m->v().vy;
         if(_h) vx *= -1;
         if(_v) vy *= -1;
         _m->setVelocity(t(), Velocity(vx, vy));
+        for(boost::shared_ptr<Listener> l: s._listeners) {
+            l->wallCollided(t(), *_m, std::abs(_h ? vx : vy));
+        }
     }
 
+    bool conservesMomentum() const {return false;}
+
 private:
     boost::shared_ptr<Marble> _m;
     bool _h;
     bool _v;
 };
 
+class Simulation::ObstacleCollision : public Event {
+public:
+    ObstacleCollision(const Date& t, boost::shared_ptr<Marble> m, boost::shared_ptr<Obstacle> o) :
+        Event(t, boost::assign::list_of(m)),
+        _m(m),
+        _o(o)
+    {}
+
+public:
+    void doApply(Simulation& s) {
+        DEBUG("Executing collision between " << _m->name() << " and obstacle at t=" << t().t);
+        Displacement n = _o->normal(t(), *_m);
+        float vn = dot(n, _m->v());
+        _m->setVelocity(t(), Velocity(_m->v().vx - 2 * vn * n.dx, _m->v().vy - 2 * vn * n.dy));
+        for(boost::shared_ptr<Listener> l: s._listeners) {
+            l->obstacleCollided(t(), *_m, *_o, std::abs(vn));
+        }
+    }
+
+    bool conservesMomentum() const {return false;}
+
+private:
+    boost::shared_ptr<Marble> _m;
+    boost::shared_ptr<Obstacle> _o;
+};
+
+class Simulation::HorizonReached : public Event {
+public:
+    HorizonReached(const Date& t, boost::shared_ptr<Marble> m) :
+        Event(t, boost::assign::list_of(m)),
+        _m(m)
+    {}
+
+public:
+    void doApply(Simulation& s) {
+        DEBUG("Reached horizon of " << _m->name() << " at t=" << t().t);
+        s.scheduleNextMarblesCollisions(_m);
+    }
+
+    bool changesTrajectories() const {return false;}
+
+private:
+    boost::shared_ptr<Marble> _m;
+};
+
 void Simulation::scheduleInitialEvents() {
     for(boost::shared_ptr<Marble> m1: _marbles) {
         for(boost::shared_ptr<Marble> m2: _marbles) {
             if(m1 < m2) {
-                boost::optional<Date> t = collisions::nextCollisionDate(_t, *m1, *m2);
+                boost::optional<Date> t = collisions::nextCollisionDate(_t, *m1, *m2, _horizon);
                 if(t) {
                     DEBUG("Scheduling initial collision between " << m1->name() << " and " << m2->name() << " at t=" << t->t);
                     _events.push(boost::make_shared<MarblesCollision>(*t, m1, m2));
                 }
             }
         }
+        if(_horizon) {
+            _events.push(boost::make_shared<HorizonReached>(_t + *_horizon, m1));
+        }
         scheduleNextWallCollision(m1);
+        scheduleNextObstacleCollision(m1);
     }
 }
 
 void Simulation::scheduleNextEvents(boost::shared_ptr<Marble> m1) {
+    scheduleNextMarblesCollisions(m1);
+    scheduleNextWallCollision(m1);
+    scheduleNextObstacleCollision(m1);
+}
+
+void Simulation::scheduleNextMarblesCollisions(boost::shared_ptr<Marble> m1) {
     for(boost::shared_ptr<Marble> m2: _marbles) {
-        boost::optional<Date> t = collisions::nextCollisionDate(_t, *m1, *m2);
+        boost::optional<Date> t = collisions::nextCollisionDate(_t, *m1, *m2, _horizon);
         if(t) {
             DEBUG("Scheduling next collision between " << m1->name() << " and " << m2->name() << " at t=" << t->t);
             _events.push(boost::make_shared<MarblesCollision>(*t, m1, m2));
         }
     }
-    scheduleNextWallCollision(m1);
+    if(_horizon) {
+        _events.push(boost::make_shared<HorizonReached>(_t + *_horizon, m1));
+    }
+}
+
+namespace {
+    // Duration until a marble, at p and moving at v along an axis, touches the wall at 0 or at size on this axis
+    boost::optional<Duration> durationUntilWall(float p, float v, float r, float size) {
+        if(v > 0) {
+            return Duration((size - p - r) / v);
+        }
+        if(v < 0) {
+            return Duration((r - p) / v);
+        }
+        return boost::optional<Duration>();
+    }
 }
 
 void Simulation::scheduleNextWallCollision(boost::shared_ptr<Marble> m1) {
-    if(m1->v().vx > 0) {
-        Date t(_t.t + (_w - m1->p(_t).x - m1->r()) / m1->v().vx);
-        DEBUG("Scheduling collision between " << m1->name() << " and right wall at t=" << t.t);
-        _events.push(boost::make_shared<WallCollision>(t, m1, true, false));
+    boost::optional<Duration> dt = durationUntilWall(m1->p(_t).x, m1->v().vx, m1->r(), _w);
+    if(dt) {
+        DEBUG("Scheduling collision between " << m1->name() << " and vertical wall at t=" << (_t + *dt).t);
+        _events.push(boost::make_shared<WallCollision>(_t + *dt, m1, true, false));
     }
-    if(m1->v().vx < 0) {
-        Date t(_t.t - (m1->p(_t).x - m1->r()) / m1->v().vx);
-        DEBUG("Scheduling collision between " << m1->name() << " and left wall at t=" << t.t);
-        _events.push(boost::make_shared<WallCollision>(t, m1, true, false));
+    dt = durationUntilWall(m1->p(_t).y, m1->v().vy, m1->r(), _h);
+    if(dt) {
+        DEBUG("Scheduling collision between " << m1->name() << " and horizontal wall at t=" << (_t + *dt).t);
+        _events.push(boost::make_shared<WallCollision>(_t + *dt, m1, false, true));
     }
-    if(m1->v().vy > 0) {
-        Date t(_t.t + (_h - m1->p(_t).y - m1->r()) / m1->v().vy);
-        DEBUG("Scheduling collision between " << m1->name() << " and bottom wall at t=" << t.t);
-        _events.push(boost::make_shared<WallCollision>(t, m1, false, true));
+}
+
+void Simulation::scheduleNextObstacleCollision(boost::shared_ptr<Marble> m1) {
+    // The marble can't go further than the walls
+    boost::optional<Duration> dtx = durationUntilWall(m1->p(_t).x, m1->v().vx, m1->r(), _w);
+    boost::optional<Duration> dty = durationUntilWall(m1->p(_t).y, m1->v().vy, m1->r(), _h);
+    if(!dtx && !dty) {
+        return;
+    }
+    Duration dt = !dty || (dtx && dtx->dt < dty->dt) ? *dtx : *dty;
+    auto c = _obstacles.nextCollision(_t, *m1, _t + dt);
+    if(c) {
+        DEBUG("Scheduling collision between " << m1->name() << " and obstacle at t=" << c->first.t);
+        _events.push(boost::make_shared<ObstacleCollision>(c->first, m1, c->second));
+    }
+}
+
+FramesScheduler::FramesScheduler() :
+    _outputs()
+{
+}
+
+void FramesScheduler::addSink(int framesPerSecond, boost::shared_ptr<FrameSink> sink) {
+    if(framesPerSecond <= 0) {
+        throw std::invalid_argument("Frame rate must be positive");
     }
-    if(m1->v().vy < 0) {
-        Date t(_t.t - (m1->p(_t).y - m1->r()) / m1->v().vy);
-        DEBUG("Scheduling collision between " << m1->name() << " and top wall at t=" << t.t);
-        _events.push(boost::make_shared<WallCollision>(t, m1, false, true));
+    _outputs.push_back(Output(framesPerSecond, sink));
+}
+
+void FramesScheduler::runUntil(Simulation& s, const Date& t) {
+    while(true) {
+        Output* next = 0;
+        for(Output& o: _outputs) {
+            if(!(o.next() > t) && (!next || o.next() < next->next())) {
+                next = &o;
+            }
+        }
+        if(!next) {
+            break;
+        }
+        Date d = next->next();
+        s.runUntil(d);
+        // All outputs with a frame at this exact date share the simulation step
+        for(Output& o: _outputs) {
+            if(!(o.next() < d) && !(o.next() > d)) {
+                o.sink->frame(s, o.index, o.index == 0 || s.appliedEvents() != o.events);
+                o.events = s.appliedEvents();
+                ++o.index;
+            }
+        }
     }
 }
+
 } // Namespace
@@ -61,8 +61,8 @@ bool operator<(const Date&, const Date&);
 class Marble;
 
 namespace collisions {
-    boost::optional<Date> nextCollisionDate(const Date& after, const Marble&, const Marble&);
-    boost::optional<Date> collisionDate(const Marble&, const Marble&);
+    // Collisions further than horizon after the given date are ignored
+    boost::optional<Date> nextCollisionDate(const Date& after, const Marble&, const Marble&, const boost::optional<Duration>& horizon = boost::optional<Duration>());
     void performCollision(const Date&, Marble&, Marble&);
 }
 
@@ -89,24 +89,162 @@ private:
 };
 
 
+// Static obstacles: marbles bounce on them as on walls
+class Obstacle {
+public:
+    virtual ~Obstacle() {}
+
+    // Bounding box
+    virtual Position min() const = 0;
+    virtual Position max() const = 0;
+
+    virtual boost::optional<Date> nextCollisionDate(const Date& after, const Marble&) const = 0;
+    // Unit vector normal to the obstacle, pointing towards the marble touching it at t
+    virtual Displacement normal(const Date& t, const Marble&) const = 0;
+};
+
+class Peg : public Obstacle {
+public:
+    Peg(Position center, float r);
+
+    Position center() const;
+    float r() const;
+
+    Position min() const;
+    Position max() const;
+    boost::optional<Date> nextCollisionDate(const Date& after, const Marble&) const;
+    Displacement normal(const Date&, const Marble&) const;
+
+private:
+    Position _center;
+    float _r;
+};
+
+class Segment : public Obstacle {
+public:
+    // a and b must be different (use a Peg for a point)
+    Segment(Position a, Position b);
+
+    Position a() const;
+    Position b() const;
+
+    Position min() const;
+    Position max() const;
+    boost::optional<Date> nextCollisionDate(const Date& after, const Marble&) const;
+    Displacement normal(const Date&, const Marble&) const;
+
+private:
+    Position _a;
+    Position _b;
+};
+
+// Uniform grid indexing the obstacles, so that a marble only tests the obstacles near its path
+class ObstaclesGrid {
+public:
+    ObstaclesGrid(float width, float height, float cellSize, const std::vector<boost::shared_ptr<Obstacle>>&);
+
+    const std::vector<boost::shared_ptr<Obstacle>>& obstacles() const;
+
+    // Next collision of the marble with an obstacle, if it happens before the given date
+    boost::optional<std::pair<Date, boost::shared_ptr<Obstacle>>> nextCollision(const Date& after, const Marble&, const Date& before) const;
+
+private:
+    int column(float x) const;
+    int row(float y) const;
+    void insert(std::size_t obstacle, int x, int y);
+    void insert(std::size_t obstacle, const Segment&);
+
+private:
+    float _cellSize;
+    int _columns;
+    int _rows;
+    std::vector<boost::shared_ptr<Obstacle>> _obstacles;
+    std::vector<std::vector<std::size_t>> _cells;
+    // Avoids testing several times an obstacle present in several cells
+    mutable std::vector<unsigned> _visits;
+    mutable unsigned _visit;
+};
+
+
 class Simulation {
+public:
+    // Conservation of energy and momentum, to check the precision of the simulation.
+    // Drifts are relative to the initial total energy and the initial sum of the norms of the momentums.
+    // Momentum exchanged with walls and obstacles is accounted for.
+    struct Stats {
+        std::size_t appliedEvents;
+        double energy;
+        double energyDrift;
+        double momentumDrift;
+    };
+
+    class Listener {
+    public:
+        virtual ~Listener() {}
+
+        // Called after an event has changed the trajectory of a marble
+        virtual void trajectoryChanged(const Date&, const Marble&) {}
+        // Called when a collision is applied, with the relative speed of the impact
+        virtual void marblesCollided(const Date&, const Marble&, const Marble&, float /*impactSpeed*/) {}
+        virtual void wallCollided(const Date&, const Marble&, float /*impactSpeed*/) {}
+        virtual void obstacleCollided(const Date&, const Marble&, const Obstacle&, float /*impactSpeed*/) {}
+        // Called when a drift exceeds the alarm threshold (again only after going back below it)
+        virtual void driftExceeded(const Date&, const Stats&) {}
+    };
+
 public:
     Simulation(float width, float height, const std::vector<boost::shared_ptr<Marble>>&);
+    Simulation(float width, float height, const std::vector<boost::shared_ptr<Marble>>&, const std::vector<boost::shared_ptr<Obstacle>>&, float cellSize = 32);
 
     float width() const;
     float height() const;
     const std::vector<boost::shared_ptr<Marble>>& marbles() const;
+    const std::vector<boost::shared_ptr<Obstacle>>& obstacles() const;
 
 public:
     void scheduleTickAt(const Date&);
+    void addListener(boost::shared_ptr<Listener>);
     void runUntil(const Date&);
     Date t() const;
+    // Number of events actually applied (cancelled events are not counted)
+    std::size_t appliedEvents() const;
+    Stats stats() const;
+    void setDriftAlarm(double threshold);
+    // Collisions between marbles further than horizon in the future are not scheduled: they would most probably be cancelled.
+    // Marbles are checked again after horizon, so no collision is missed.
+    // Cost: each marble is checked against all others once per horizon, so O(n²) per horizon.
+    // A short horizon can make the simulation slower than no horizon at all.
+    // Initial collisions are scheduled on the first call to runUntil, so this should be called before.
+    void setHorizon(const Duration&);
 
 private:
     float _w;
     float _h;
     std::vector<boost::shared_ptr<Marble>> _marbles;
+    ObstaclesGrid _obstacles;
+    boost::optional<Duration> _horizon;
+    bool _started;
     Date _t;
+    std::size_t _appliedEvents;
+    std::vector<boost::shared_ptr<Listener>> _listeners;
+
+private:
+    // Maintained incrementally, from the changes made by each event
+    struct Totals {
+        Totals() : energy(0), px(0), py(0) {}
+        void add(const Marble&, double sign);
+        double energy;
+        double px;
+        double py;
+    };
+    Totals _initial;
+    double _initialMomentumNorm;
+    Totals _current;
+    // Momentum given by walls and obstacles
+    double _impulseX;
+    double _impulseY;
+    boost::optional<double> _driftAlarm;
+    bool _driftAlarmRaised;
 
 private:
     class Event {
@@ -120,6 +258,10 @@ private:
 
     private:
         virtual void doApply(Simulation&) = 0;
+        // False for events involving an outside object, like walls
+        virtual bool conservesMomentum() const {return true;}
+        // False for events that only schedule other events
+        virtual bool changesTrajectories() const {return true;}
 
     private:
         struct ImpactedMarble {
@@ -140,10 +282,45 @@ private:
 
     class MarblesCollision;
     class WallCollision;
+    class ObstacleCollision;
+    class HorizonReached;
 
     void scheduleInitialEvents();
     void scheduleNextEvents(boost::shared_ptr<Marble>);
+    void scheduleNextMarblesCollisions(boost::shared_ptr<Marble>);
     void scheduleNextWallCollision(boost::shared_ptr<Marble>);
+    void scheduleNextObstacleCollision(boost::shared_ptr<Marble>);
+};
+
+
+class FrameSink {
+public:
+    virtual ~FrameSink() {}
+
+    // eventful is false when no event was applied since the previous frame of this sink,
+    // so this frame can be produced by extrapolating the trajectories of the previous one.
+    virtual void frame(const Simulation&, int index, bool eventful) = 0;
+};
+
+// Feeds several sinks, each at its own frame rate, from a single pass of simulation
+class FramesScheduler {
+public:
+    FramesScheduler();
+
+    void addSink(int framesPerSecond, boost::shared_ptr<FrameSink>);
+    // Produces all frames dated before or at t
+    void runUntil(Simulation&, const Date&);
+
+private:
+    struct Output {
+        Output(int framesPerSecond_, boost::shared_ptr<FrameSink> sink_) : framesPerSecond(framesPerSecond_), sink(sink_), index(0), events(0) {}
+        Date next() const {return Date(double(index) / framesPerSecond);}
+        int framesPerSecond;
+        boost::shared_ptr<FrameSink> sink;
+        int index;
+        std::size_t events;
+    };
+    std::vector<Output> _outputs;
 };
 
 } // Namespace
@@ -0,0 +1,174 @@
+#include "drawers.hpp"
+
+#include <cmath>
+#include <thread>
+#include <algorithm>
+
+using namespace Cairo;
+
+
+namespace collide {
+
+GlyphCache::GlyphCache(double red, double green, double blue) :
+    _red(red),
+    _green(green),
+    _blue(blue),
+    _glyphs()
+{
+}
+
+RefPtr<ImageSurface> GlyphCache::glyph(float r) {
+    auto it = _glyphs.find(r);
+    if(it == _glyphs.end()) {
+        // One pixel of margin for antialiasing
+        int size = int(std::ceil(2 * r)) + 2;
+        RefPtr<ImageSurface> img = ImageSurface::create(FORMAT_ARGB32, size, size);
+        RefPtr<Context> ctx = Context::create(img);
+        ctx->set_source_rgb(_red, _green, _blue);
+        ctx->arc(r + 1, r + 1, r, 0, 2 * M_PI);
+        ctx->fill();
+        it = _glyphs.insert(std::make_pair(r, img)).first;
+    }
+    return it->second;
+}
+
+void GlyphCache::draw(RefPtr<Context> ctx, const Position& p, float r) {
+    ctx->set_source(glyph(r), p.x - r - 1, p.y - r - 1);
+    ctx->paint();
+}
+
+
+namespace {
+    void drawObstacles(const Simulation& s, RefPtr<Context> ctx) {
+        ctx->set_source_rgb(.3, .3, .6);
+        ctx->set_line_width(1);
+        for(auto o: s.obstacles()) {
+            if(auto peg = boost::dynamic_pointer_cast<Peg>(o)) {
+                ctx->arc(peg->center().x, peg->center().y, peg->r(), 0, 2 * M_PI);
+                ctx->fill();
+            } else if(auto segment = boost::dynamic_pointer_cast<Segment>(o)) {
+                ctx->move_to(segment->a().x, segment->a().y);
+                ctx->line_to(segment->b().x, segment->b().y);
+                ctx->stroke();
+            }
+        }
+    }
+}
+
+
+int Panel::width(const Simulation& s) const {
+    return int(s.width());
+}
+
+int Panel::height(const Simulation& s) const {
+    return int(s.height());
+}
+
+
+MarblesPanel::MarblesPanel() :
+    _glyphs(0, 0, 0)
+{
+}
+
+void MarblesPanel::draw(const Simulation& s, RefPtr<Context> ctx) {
+    ctx->set_source_rgb(.9, .9, .9);
+    ctx->paint();
+    drawObstacles(s, ctx);
+    for(auto m: s.marbles()) {
+        _glyphs.draw(ctx, m->p(s.t()), m->r());
+    }
+}
+
+
+VelocitiesPanel::VelocitiesPanel(float secondsPerLength, float widthPerMass) :
+    _secondsPerLength(secondsPerLength),
+    _widthPerMass(widthPerMass),
+    _glyphs(.7, .7, .7)
+{
+}
+
+void VelocitiesPanel::draw(const Simulation& s, RefPtr<Context> ctx) {
+    ctx->set_source_rgb(.9, .9, .9);
+    ctx->paint();
+    drawObstacles(s, ctx);
+    for(auto m: s.marbles()) {
+        _glyphs.draw(ctx, m->p(s.t()), m->r());
+    }
+    ctx->set_source_rgb(.8, 0, 0);
+    ctx->set_line_cap(LINE_CAP_ROUND);
+    for(auto m: s.marbles()) {
+        Position p = m->p(s.t());
+        Position q = p + m->v() * Duration(_secondsPerLength);
+        ctx->set_line_width(_widthPerMass * m->m());
+        ctx->move_to(p.x, p.y);
+        ctx->line_to(q.x, q.y);
+        ctx->stroke();
+    }
+}
+
+
+CompositePanel::CompositePanel(const std::vector<boost::shared_ptr<Panel>>& panels, int columns) :
+    _panels(panels),
+    _columns(columns)
+{
+}
+
+int CompositePanel::rows() const {
+    return (int(_panels.size()) + _columns - 1) / _columns;
+}
+
+int CompositePanel::width(const Simulation& s) const {
+    int w = 0;
+    for(auto panel: _panels) {
+        w = std::max(w, panel->width(s));
+    }
+    return _columns * w;
+}
+
+int CompositePanel::height(const Simulation& s) const {
+    int h = 0;
+    for(auto panel: _panels) {
+        h = std::max(h, panel->height(s));
+    }
+    return rows() * h;
+}
+
+void CompositePanel::draw(const Simulation& s, RefPtr<Context> ctx) {
+    // Cairo::RefPtr's reference count is not atomic, so all RefPtrs are created, copied and destroyed on this thread.
+    // Workers only get raw pointers to a panel and to its context, which this thread doesn't touch until they're joined.
+    // Each panel owns its glyphs and draws on its own surface, so panels don't share any Cairo object.
+    std::vector<RefPtr<ImageSurface>> images;
+    images.reserve(_panels.size());
+    std::vector<RefPtr<Context>> contexts;
+    contexts.reserve(_panels.size());
+    for(auto panel: _panels) {
+        images.push_back(ImageSurface::create(FORMAT_RGB24, panel->width(s), panel->height(s)));
+        contexts.push_back(Context::create(images.back()));
+    }
+    // Starting a thread costs a few dozens of microseconds, negligible compared to drawing and encoding a frame,
+    // so we don't bother keeping a pool of workers. The first panel is drawn on this thread.
+    std::vector<std::thread> threads;
+    threads.reserve(_panels.size());
+    for(std::size_t i = 1; i < _panels.size(); ++i) {
+        Panel* panel = _panels[i].get();
+        RefPtr<Context>* context = &contexts[i];
+        threads.push_back(std::thread([&s, panel, context]() {
+            panel->draw(s, *context);
+        }));
+    }
+    if(!_panels.empty()) {
+        _panels[0]->draw(s, contexts[0]);
+    }
+    for(auto& thread: threads) {
+        thread.join();
+    }
+
+    int w = width(s) / _columns;
+    int h = height(s) / rows();
+    for(std::size_t i = 0; i != images.size(); ++i) {
+        ctx->set_source(images[i], w * (i % _columns), h * (i / _columns));
+        ctx->paint();
+    }
+}
+
+} // Namespace
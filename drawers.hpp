@@ -0,0 +1,83 @@
+#ifndef drawers_hpp
+#define drawers_hpp
+
+#include <map>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <cairomm/cairomm.h>
+
+#include "collide.hpp"
+
+
+namespace collide {
+
+// Marbles pre-rendered once per radius, then blitted, instead of building an arc per marble and per frame
+class GlyphCache {
+public:
+    GlyphCache(double red, double green, double blue);
+
+    void draw(Cairo::RefPtr<Cairo::Context>, const Position&, float r);
+
+private:
+    Cairo::RefPtr<Cairo::ImageSurface> glyph(float r);
+
+private:
+    double _red;
+    double _green;
+    double _blue;
+    std::map<float, Cairo::RefPtr<Cairo::ImageSurface>> _glyphs;
+};
+
+class Panel {
+public:
+    virtual ~Panel() {}
+
+    virtual int width(const Simulation&) const;
+    virtual int height(const Simulation&) const;
+    virtual void draw(const Simulation&, Cairo::RefPtr<Cairo::Context>) = 0;
+};
+
+class MarblesPanel : public Panel {
+public:
+    MarblesPanel();
+
+    void draw(const Simulation&, Cairo::RefPtr<Cairo::Context>);
+
+private:
+    GlyphCache _glyphs;
+};
+
+// Velocity vectors, long as speed and thick as mass
+class VelocitiesPanel : public Panel {
+public:
+    VelocitiesPanel(float secondsPerLength = .2, float widthPerMass = 1);
+
+    void draw(const Simulation&, Cairo::RefPtr<Cairo::Context>);
+
+private:
+    float _secondsPerLength;
+    float _widthPerMass;
+    GlyphCache _glyphs;
+};
+
+// Several panels on a grid, each rendered concurrently on its own thread
+class CompositePanel : public Panel {
+public:
+    CompositePanel(const std::vector<boost::shared_ptr<Panel>>&, int columns);
+
+    int width(const Simulation&) const;
+    int height(const Simulation&) const;
+    void draw(const Simulation&, Cairo::RefPtr<Cairo::Context>);
+
+private:
+    int rows() const;
+
+private:
+    std::vector<boost::shared_ptr<Panel>> _panels;
+    int _columns;
+};
+
+} // Namespace
+
+#endif // Include guard
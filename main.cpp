@@ -1,4 +1,5 @@
 #include <iostream>
+#include <stdexcept>
 #include <cmath>
 
 #include <boost/format.hpp>
@@ -11,36 +12,54 @@
 #include <cairomm/cairomm.h>
 
 #include "collide.hpp"
+#include "trajectories.hpp"
+#include "sound.hpp"
+#include "preview.hpp"
+#include "drawers.hpp"
 
 using namespace Cairo;
 using namespace collide;
 
 
-struct FramesDrawer {
-    void draw(const Simulation& s, int i) {
-        RefPtr<ImageSurface> img = ImageSurface::create(FORMAT_RGB24, int(s.width()), int(s.height()));
-        RefPtr<Context> ctx = Context::create(img);
-        ctx->set_source_rgb(.9, .9, .9);
-        ctx->paint();
-        ctx->set_source_rgb(0, 0, 0);
-        for(auto m: s.marbles()) {
-            ctx->arc(m->p(s.t()).x, m->p(s.t()).y, m->r(), 0, 2 * M_PI);
-            ctx->close_path();
-        }
-        ctx->fill();
-        img->write_to_png((boost::format("frames/%08d.png") % i).str());
+struct FramesDrawer : FrameSink {
+    FramesDrawer(boost::shared_ptr<Panel> panel_, std::string pattern_) : panel(panel_), pattern(pattern_) {}
+    void frame(const Simulation& s, int i, bool) {
+        RefPtr<ImageSurface> img = ImageSurface::create(FORMAT_RGB24, panel->width(s), panel->height(s));
+        panel->draw(s, Context::create(img));
+        img->write_to_png((boost::format(pattern) % i).str());
     }
+    boost::shared_ptr<Panel> panel;
+    std::string pattern;
 };
 
-int main() {
+const char* usage = "Usage: \"collide\" to generate the frames, or \"collide live [spacing [speed]]\" to preview the simulation with \"viewer\"\n"
+    "  spacing: positive integer, distance between initial positions of small marbles (default 25)\n"
+    "  speed: positive number, how faster than real time the simulation runs (default 1)";
+
+int main(int argc, char* argv[]) {
+    const bool live = argc > 1 && std::string(argv[1]) == "live";
+    int spacing = 25;
+    float speed = 1;
+    try {
+        if(argc > 1 && !live) throw std::invalid_argument(argv[1]);
+        if(argc > 4) throw std::invalid_argument(argv[4]);
+        if(argc > 2) spacing = boost::lexical_cast<int>(argv[2]);
+        if(argc > 3) speed = boost::lexical_cast<float>(argv[3]);
+        if(spacing <= 0) throw std::invalid_argument(argv[2]);
+        if(!(speed > 0)) throw std::invalid_argument(argv[3]);
+    } catch(const std::exception& e) {
+        std::cerr << "Invalid argument: " << e.what() << "\n" << usage << std::endl;
+        return 1;
+    }
+
     std::vector<boost::shared_ptr<Marble>> marbles;
     Position pM(320, 240);
     marbles.push_back(boost::make_shared<Marble>("M", 50, 10, pM, Velocity(0, 0)));
     boost::random::mt19937 mt(42);
     boost::random::uniform_01<boost::random::mt19937> gen(mt);
 
-    for(int x = 20; x < 640; x += 25) {
-        for(int y = 15; y < 480; y += 25) {
+    for(int x = 20; x < 640; x += spacing) {
+        for(int y = 15; y < 480; y += spacing) {
             Position p(x, y);
             if((p - pM).length() > 70) {
                 marbles.push_back(boost::make_shared<Marble>("m", 3, 1, p, Velocity((200 * gen() - 100), (200 * gen() - 100))));
@@ -48,15 +67,36 @@ int main() {
         }
     }
     Simulation s(640, 480, marbles);
-    FramesDrawer d;
+    s.setHorizon(Duration(1));
     const int duration = 60;
+
+    if(live) {
+        PreviewServer server("collide.sock", 0.25);
+        std::cout << "Simulating " << marbles.size() << " marbles live, run \"./viewer collide.sock\" to watch" << std::endl;
+        runLive(s, server, speed, 25, Date(duration));
+        std::cout << server.sentSnapshots() << " snapshots sent, " << server.droppedSnapshots() << " dropped" << std::endl;
+        return 0;
+    }
+
+    auto segments = boost::make_shared<SegmentsExporter>(s, "trajectories.bin", TrajectoryWriter::Binary);
+    s.addListener(segments);
+    auto sound = boost::make_shared<CollisionsSound>("collisions.wav");
+    s.addListener(sound);
+    std::vector<boost::shared_ptr<Panel>> panels;
+    panels.push_back(boost::make_shared<MarblesPanel>());
+    panels.push_back(boost::make_shared<VelocitiesPanel>());
+    // A second, slower, frame rate from the same simulation, to compare them
+    FramesScheduler scheduler;
+    scheduler.addSink(25, boost::make_shared<FramesDrawer>(boost::make_shared<CompositePanel>(panels, 2), "frames/%08d.png"));
+    scheduler.addSink(10, boost::make_shared<FramesDrawer>(boost::make_shared<MarblesPanel>(), "frames/10fps/%08d.png"));
     std::cout << "Simulating " << marbles.size() << " marbles" << std::flush;
-    for(int i = 0; i != duration * 25 + 1; ++i) {
-        s.runUntil(Date(i / 25.));
-        d.draw(s, i);
-        if(i % 25 == 0) {
-            std::cout << "." << std::flush;
-        }
+    for(int i = 0; i != duration + 1; ++i) {
+        scheduler.runUntil(s, Date(i));
+        std::cout << "." << std::flush;
     }
+    segments->close();
+    sound->close(Date(duration));
     std::cout << std::endl;
+    Simulation::Stats stats = s.stats();
+    std::cout << stats.appliedEvents << " events, energy drift " << stats.energyDrift << ", momentum drift " << stats.momentumDrift << std::endl;
 }
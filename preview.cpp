@@ -0,0 +1,202 @@
+#include "preview.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+namespace collide {
+
+namespace {
+    // Message: uint32 index, float t, uint16 width, uint16 height, uint32 count, then count times int16 x, int16 y, uint16 r
+    const std::size_t headerSize = 16;
+    const std::size_t diskSize = 6;
+    // Large enough for tens of thousands of marbles
+    const std::size_t maxMessageSize = 1 << 20;
+
+    sockaddr_un address(const std::string& path) {
+        sockaddr_un a;
+        std::memset(&a, 0, sizeof(a));
+        a.sun_family = AF_UNIX;
+        if(path.size() >= sizeof(a.sun_path)) {
+            throw std::runtime_error("Socket path too long: " + path);
+        }
+        std::strcpy(a.sun_path, path.c_str());
+        return a;
+    }
+
+    std::int16_t clamp(float v) {
+        return std::int16_t(std::max(-32768.f, std::min(32767.f, v)));
+    }
+}
+
+PreviewServer::PreviewServer(const std::string& socketPath, float scale) :
+    _path(socketPath),
+    _scale(scale),
+    _socket(socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0)),
+    _viewer(-1),
+    _index(0),
+    _sent(0),
+    _dropped(0),
+    _message()
+{
+    if(_socket < 0) {
+        throw std::runtime_error("Unable to create preview socket");
+    }
+    sockaddr_un a = address(_path);
+    unlink(_path.c_str());
+    if(bind(_socket, reinterpret_cast<sockaddr*>(&a), sizeof(a)) != 0 || listen(_socket, 1) != 0) {
+        close(_socket);
+        throw std::runtime_error("Unable to listen on " + _path);
+    }
+}
+
+PreviewServer::~PreviewServer() {
+    closeViewer();
+    close(_socket);
+    unlink(_path.c_str());
+}
+
+void PreviewServer::acceptViewer() {
+    _viewer = accept4(_socket, 0, 0, SOCK_NONBLOCK);
+}
+
+void PreviewServer::closeViewer() {
+    if(_viewer >= 0) {
+        close(_viewer);
+        _viewer = -1;
+    }
+}
+
+bool PreviewServer::send(const Simulation& s) {
+    std::uint32_t index = _index++;
+    if(_viewer < 0) {
+        acceptViewer();
+    }
+    if(_viewer < 0) {
+        ++_dropped;
+        return false;
+    }
+
+    std::uint32_t count = s.marbles().size();
+    _message.resize(headerSize + count * diskSize);
+    char* p = &_message[0];
+    float t = s.t().t;
+    std::uint16_t width = s.width() * _scale;
+    std::uint16_t height = s.height() * _scale;
+    std::memcpy(p, &index, 4);
+    std::memcpy(p + 4, &t, 4);
+    std::memcpy(p + 8, &width, 2);
+    std::memcpy(p + 10, &height, 2);
+    std::memcpy(p + 12, &count, 4);
+    p += headerSize;
+    for(auto m: s.marbles()) {
+        Position position = m->p(s.t());
+        Snapshot::Disk d = {clamp(position.x * _scale), clamp(position.y * _scale), std::uint16_t(std::max(1.f, m->r() * _scale))};
+        std::memcpy(p, &d.x, 2);
+        std::memcpy(p + 2, &d.y, 2);
+        std::memcpy(p + 4, &d.r, 2);
+        p += diskSize;
+    }
+
+    if(::send(_viewer, &_message[0], _message.size(), MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EMSGSIZE && errno != ENOBUFS) {
+            // Viewer is gone. Wait for the next one.
+            closeViewer();
+        }
+        ++_dropped;
+        return false;
+    }
+    ++_sent;
+    return true;
+}
+
+std::size_t PreviewServer::sentSnapshots() const {
+    return _sent;
+}
+
+std::size_t PreviewServer::droppedSnapshots() const {
+    return _dropped;
+}
+
+
+PreviewClient::PreviewClient(const std::string& socketPath) :
+    _socket(socket(AF_UNIX, SOCK_SEQPACKET, 0)),
+    _message(maxMessageSize)
+{
+    if(_socket < 0) {
+        throw std::runtime_error("Unable to create preview socket");
+    }
+    sockaddr_un a = address(socketPath);
+    if(connect(_socket, reinterpret_cast<sockaddr*>(&a), sizeof(a)) != 0) {
+        close(_socket);
+        throw std::runtime_error("Unable to connect to " + socketPath);
+    }
+}
+
+PreviewClient::~PreviewClient() {
+    close(_socket);
+}
+
+bool PreviewClient::receive(Snapshot& snapshot, int timeoutMilliseconds) {
+    pollfd fd = {_socket, POLLIN, 0};
+    if(poll(&fd, 1, timeoutMilliseconds) <= 0) {
+        return false;
+    }
+    ssize_t size = recv(_socket, &_message[0], _message.size(), 0);
+    if(size < ssize_t(headerSize)) {
+        return false;
+    }
+    const char* p = &_message[0];
+    std::uint32_t count;
+    std::memcpy(&snapshot.index, p, 4);
+    std::memcpy(&snapshot.t, p + 4, 4);
+    std::memcpy(&snapshot.width, p + 8, 2);
+    std::memcpy(&snapshot.height, p + 10, 2);
+    std::memcpy(&count, p + 12, 4);
+    if(std::size_t(size) != headerSize + count * diskSize) {
+        return false;
+    }
+    p += headerSize;
+    snapshot.disks.resize(count);
+    for(Snapshot::Disk& d: snapshot.disks) {
+        std::memcpy(&d.x, p, 2);
+        std::memcpy(&d.y, p + 2, 2);
+        std::memcpy(&d.r, p + 4, 2);
+        p += diskSize;
+    }
+    return true;
+}
+
+
+void runLive(Simulation& s, PreviewServer& server, float speed, int framesPerSecond, const Date& end) {
+    typedef std::chrono::steady_clock Clock;
+    const Clock::time_point start = Clock::now();
+    const Duration origin = s.t() - Date(0);
+    for(int frame = 0; true; ++frame) {
+        // Date of the simulation corresponding to the current wall clock
+        float elapsed = std::chrono::duration<float>(Clock::now() - start).count();
+        Date t = Date(0) + origin + Duration(speed * elapsed);
+        if(t > end) {
+            t = end;
+        }
+        s.runUntil(t);
+        server.send(s);
+        if(!(t < end)) {
+            break;
+        }
+        // Skip frames whose date is already past if the simulation was too slow
+        frame = std::max(frame, int(elapsed * framesPerSecond));
+        std::this_thread::sleep_until(start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<float>(float(frame + 1) / framesPerSecond)));
+    }
+}
+
+} // Namespace
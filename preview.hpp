@@ -0,0 +1,74 @@
+#ifndef preview_hpp
+#define preview_hpp
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "collide.hpp"
+
+
+namespace collide {
+
+// Downscaled positions of the marbles at a given date
+struct Snapshot {
+    struct Disk {
+        std::int16_t x;
+        std::int16_t y;
+        std::uint16_t r;
+    };
+    std::uint32_t index;
+    float t;
+    std::uint16_t width;
+    std::uint16_t height;
+    std::vector<Disk> disks;
+};
+
+// Streams snapshots to one local viewer, through a Unix socket (one message per snapshot).
+// Snapshots are dropped when there is no viewer or when it doesn't keep up, so the simulation never waits.
+class PreviewServer {
+public:
+    PreviewServer(const std::string& socketPath, float scale);
+    ~PreviewServer();
+
+    // Returns false if the snapshot was dropped
+    bool send(const Simulation&);
+    std::size_t sentSnapshots() const;
+    std::size_t droppedSnapshots() const;
+
+private:
+    void acceptViewer();
+    void closeViewer();
+
+private:
+    std::string _path;
+    float _scale;
+    int _socket;
+    int _viewer;
+    std::uint32_t _index;
+    std::size_t _sent;
+    std::size_t _dropped;
+    std::vector<char> _message;
+};
+
+class PreviewClient {
+public:
+    PreviewClient(const std::string& socketPath);
+    ~PreviewClient();
+
+    // Returns false if no snapshot arrived before the timeout, or if the server is gone
+    bool receive(Snapshot&, int timeoutMilliseconds);
+
+private:
+    int _socket;
+    std::vector<char> _message;
+};
+
+// Runs the simulation in real time (or speed times faster) until the given date,
+// sending at most framesPerSecond snapshots per second of wall clock.
+// If the simulation can't keep up, snapshots are skipped, not delayed.
+void runLive(Simulation&, PreviewServer&, float speed, int framesPerSecond, const Date& end);
+
+} // Namespace
+
+#endif // Include guard
@@ -0,0 +1,165 @@
+#include "sound.hpp"
+
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+
+
+namespace collide {
+
+namespace {
+    std::vector<float> impulse(int sampleRate, float frequency) {
+        // A sine decaying in a few milliseconds
+        std::vector<float> samples(sampleRate / 25);
+        for(std::size_t i = 0; i != samples.size(); ++i) {
+            float t = float(i) / sampleRate;
+            samples[i] = std::sin(2 * M_PI * frequency * t) * std::exp(-t / 0.006);
+        }
+        return samples;
+    }
+
+    void writeLittleEndian(std::ofstream& file, std::uint32_t value, int bytes) {
+        for(int i = 0; i != bytes; ++i) {
+            file.put(char((value >> (8 * i)) & 0xFF));
+        }
+    }
+
+    void writeWavHeader(std::ofstream& file, int sampleRate, std::uint32_t samples) {
+        file.write("RIFF", 4);
+        writeLittleEndian(file, 36 + 2 * samples, 4);
+        file.write("WAVEfmt ", 8);
+        writeLittleEndian(file, 16, 4);
+        writeLittleEndian(file, 1, 2); // PCM
+        writeLittleEndian(file, 1, 2); // Mono
+        writeLittleEndian(file, sampleRate, 4);
+        writeLittleEndian(file, 2 * sampleRate, 4);
+        writeLittleEndian(file, 2, 2);
+        writeLittleEndian(file, 16, 2);
+        file.write("data", 4);
+        writeLittleEndian(file, 2 * samples, 4);
+    }
+
+    // Impact speed giving the loudest tick
+    const float loudSpeed = 200;
+}
+
+CollisionsSound::CollisionsSound(const std::string& filename, int sampleRate, std::size_t capacity) :
+    _filename(filename),
+    _sampleRate(sampleRate),
+    _tick(impulse(sampleRate, 2000)),
+    _tock(impulse(sampleRate, 700)),
+    _impacts(capacity),
+    _dropped(0),
+    _closing(false),
+    _mix(4 * _tick.size(), 0),
+    _written(0),
+    _end(0),
+    _pcm(_mix.size()),
+    _file(filename.c_str(), std::ios::binary | std::ios::trunc),
+    _thread()
+{
+    if(!_file) {
+        throw std::runtime_error("Unable to open " + _filename);
+    }
+    // Sizes are set when closing
+    writeWavHeader(_file, _sampleRate, 0);
+    _thread = std::thread(&CollisionsSound::run, this);
+}
+
+CollisionsSound::~CollisionsSound() {
+    if(_thread.joinable()) {
+        try {
+            close(Date(0));
+        } catch(const std::runtime_error&) {
+            // Can't report from a destructor: call close explicitly to get errors
+        }
+    }
+}
+
+void CollisionsSound::marblesCollided(const Date& t, const Marble&, const Marble&, float impactSpeed) {
+    queue(t, impactSpeed, false);
+}
+
+void CollisionsSound::wallCollided(const Date& t, const Marble&, float impactSpeed) {
+    queue(t, impactSpeed, true);
+}
+
+void CollisionsSound::obstacleCollided(const Date& t, const Marble&, const Obstacle&, float impactSpeed) {
+    queue(t, impactSpeed, true);
+}
+
+void CollisionsSound::queue(const Date& t, float impactSpeed, bool static_) {
+    Impact impact = {t.t, std::min(1.f, impactSpeed / loudSpeed), static_};
+    if(!_impacts.push(impact)) {
+        ++_dropped;
+    }
+}
+
+std::size_t CollisionsSound::droppedImpacts() const {
+    return _dropped;
+}
+
+void CollisionsSound::run() {
+    while(true) {
+        // Read _closing before draining, so that no impact queued before close is missed
+        bool closing = _closing;
+        Impact impact;
+        bool mixed = false;
+        while(_impacts.pop(impact)) {
+            mix(impact);
+            mixed = true;
+        }
+        if(closing) {
+            break;
+        }
+        if(!mixed) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+    }
+}
+
+void CollisionsSound::mix(const Impact& impact) {
+    const std::vector<float>& samples = impact.static_ ? _tock : _tick;
+    // Impacts come in chronological order, so samples before this one are final
+    std::uint32_t start = std::max(_written, std::uint32_t(impact.t * _sampleRate));
+    if(start + samples.size() > _written + _mix.size()) {
+        write(start - _written);
+    }
+    for(std::size_t i = 0; i != samples.size(); ++i) {
+        _mix[start - _written + i] += 0.3 * impact.amplitude * samples[i];
+    }
+    _end = std::max(_end, std::uint32_t(start + samples.size()));
+}
+
+void CollisionsSound::write(std::size_t samples) {
+    while(samples != 0) {
+        std::size_t n = std::min(samples, _mix.size());
+        for(std::size_t i = 0; i != n; ++i) {
+            _pcm[i] = std::int16_t(32767 * std::max(-1.f, std::min(1.f, _mix[i])));
+        }
+        // WAV samples are little endian, like the machines we run on
+        _file.write(reinterpret_cast<const char*>(&_pcm[0]), n * sizeof(std::int16_t));
+        std::copy(_mix.begin() + n, _mix.end(), _mix.begin());
+        std::fill(_mix.end() - n, _mix.end(), 0);
+        _written += n;
+        samples -= n;
+    }
+}
+
+void CollisionsSound::close(const Date& end) {
+    if(!_thread.joinable()) {
+        return;
+    }
+    _closing = true;
+    _thread.join();
+    write(std::max(_end, std::uint32_t(end.t * _sampleRate)) - _written);
+    _file.seekp(0);
+    writeWavHeader(_file, _sampleRate, _written);
+    _file.close();
+    if(!_file) {
+        throw std::runtime_error("Unable to write " + _filename);
+    }
+}
+
+} // Namespace
@@ -0,0 +1,101 @@
+#ifndef sound_hpp
+#define sound_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "collide.hpp"
+
+
+namespace collide {
+
+// Lock-free queue between one producer thread and one consumer thread, allocated once
+template<typename T>
+class RingBuffer {
+public:
+    RingBuffer(std::size_t capacity) : _items(capacity + 1), _head(0), _tail(0) {}
+
+    // Returns false, without waiting, if the buffer is full
+    bool push(const T& item) {
+        std::size_t tail = _tail.load(std::memory_order_relaxed);
+        std::size_t next = (tail + 1) % _items.size();
+        if(next == _head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        _items[tail] = item;
+        _tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // Returns false if the buffer is empty
+    bool pop(T& item) {
+        std::size_t head = _head.load(std::memory_order_relaxed);
+        if(head == _tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = _items[head];
+        _head.store((head + 1) % _items.size(), std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::vector<T> _items;
+    std::atomic<std::size_t> _head;
+    std::atomic<std::size_t> _tail;
+};
+
+// Generates a mono 16 bits WAV file with a "tick" on each collision, louder for faster impacts.
+// The simulation thread only queues the impacts: they are mixed and written on a background thread.
+// Impacts are dropped (and counted) if the queue is full, so the simulation never waits.
+class CollisionsSound : public Simulation::Listener {
+public:
+    // Throws if the file can't be created
+    CollisionsSound(const std::string& filename, int sampleRate = 44100, std::size_t capacity = 65536);
+    ~CollisionsSound();
+
+    void marblesCollided(const Date&, const Marble&, const Marble&, float impactSpeed);
+    void wallCollided(const Date&, const Marble&, float impactSpeed);
+    void obstacleCollided(const Date&, const Marble&, const Obstacle&, float impactSpeed);
+
+    // Mixes the remaining impacts and pads the sound with silence until the given date.
+    // Throws if the file couldn't be written. Calling it again has no effect.
+    void close(const Date& end);
+    std::size_t droppedImpacts() const;
+
+private:
+    struct Impact {
+        float t;
+        float amplitude;
+        bool static_;
+    };
+    void queue(const Date&, float impactSpeed, bool static_);
+    void run();
+    void mix(const Impact&);
+    void write(std::size_t samples);
+
+private:
+    std::string _filename;
+    int _sampleRate;
+    // Sounds of impacts between marbles, and with walls and obstacles
+    std::vector<float> _tick;
+    std::vector<float> _tock;
+    RingBuffer<Impact> _impacts;
+    std::size_t _dropped;
+    std::atomic<bool> _closing;
+    // Samples not written yet, starting at sample number _written
+    std::vector<float> _mix;
+    std::uint32_t _written;
+    // End of the last mixed impact
+    std::uint32_t _end;
+    std::vector<std::int16_t> _pcm;
+    std::ofstream _file;
+    std::thread _thread;
+};
+
+} // Namespace
+
+#endif // Include guard
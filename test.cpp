@@ -3,8 +3,18 @@
 #include <boost/test/unit_test.hpp>
 #include <boost/assign.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/optional/optional_io.hpp>
+#include <boost/tuple/tuple.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+
+#include <fstream>
+#include <algorithm>
 
 #include "collide.hpp"
+#include "trajectories.hpp"
+#include "sound.hpp"
+#include "preview.hpp"
 
 namespace ba = boost::assign;
 
@@ -256,3 +266,394 @@ BOOST_AUTO_TEST_CASE(SimulateCollisionsWithWalls) {
     s.runUntil(Date(8.1));
     BOOST_CHECK_EQUAL(m->v(), Velocity(4, 3));
 }
+
+BOOST_AUTO_TEST_CASE(ExportSegmentsAsCsv) {
+    auto m = boost::make_shared<Marble>("FOO", 1, 1, Position(1, 7), Velocity(4, 3));
+    Simulation s(18, 14, ba::list_of(m));
+    auto e = boost::make_shared<SegmentsExporter>(s, "test_segments.csv", TrajectoryWriter::Csv);
+    s.addListener(e);
+    s.runUntil(Date(4.1));
+    e->close();
+
+    std::ifstream f("test_segments.csv");
+    std::vector<std::string> lines;
+    for(std::string line; std::getline(f, line);) {
+        lines.push_back(line);
+    }
+    BOOST_REQUIRE_EQUAL(lines.size(), 4);
+    BOOST_CHECK_EQUAL(lines[0], "marble,t,x,y,vx,vy");
+    BOOST_CHECK_EQUAL(lines[1], "0,0,1,7,4,3");
+    BOOST_CHECK_EQUAL(lines[2], "0,2,9,13,4,-3");
+    BOOST_CHECK_EQUAL(lines[3], "0,4,17,7,-4,-3");
+}
+
+BOOST_AUTO_TEST_CASE(TrajectoryWriterErrors) {
+    BOOST_CHECK_THROW(TrajectoryWriter("no_such_directory/trajectories.csv", TrajectoryWriter::Csv), std::runtime_error);
+    TrajectoryWriter w("test_closed.csv", TrajectoryWriter::Csv);
+    w.close();
+    w.close();
+    BOOST_CHECK_THROW(w.write(0, Date(0), Position(0, 0), Velocity(0, 0)), std::logic_error);
+}
+
+BOOST_AUTO_TEST_CASE(ExportFramesAsBinary) {
+    auto m1 = boost::make_shared<Marble>("1", 1, 1, Position(1, 5), Velocity(1, 0));
+    auto m2 = boost::make_shared<Marble>("2", 1, 1, Position(9, 5), Velocity(-1, 0));
+    Simulation s(10, 10, ba::list_of(m1)(m2));
+    {
+        FramesExporter e("test_frames.bin", TrajectoryWriter::Binary);
+        for(int i = 0; i != 3; ++i) {
+            s.runUntil(Date(i));
+            e.sample(s);
+        }
+    }
+
+    std::ifstream f("test_frames.bin", std::ios::binary);
+    char magic[8];
+    f.read(magic, 8);
+    BOOST_CHECK_EQUAL(std::string(magic, 8), "MCTRAJ01");
+    std::uint32_t records;
+    f.read(reinterpret_cast<char*>(&records), sizeof(records));
+    BOOST_REQUIRE_EQUAL(records, 6);
+    std::uint32_t marble;
+    float values[5];
+    for(std::uint32_t i = 0; i != records; ++i) {
+        f.read(reinterpret_cast<char*>(&marble), sizeof(marble));
+        f.read(reinterpret_cast<char*>(values), sizeof(values));
+    }
+    BOOST_CHECK_EQUAL(marble, 1);
+    BOOST_CHECK_EQUAL(Date(values[0]), Date(2));
+    BOOST_CHECK_EQUAL(Position(values[1], values[2]), Position(7, 5));
+    BOOST_CHECK_EQUAL(Velocity(values[3], values[4]), Velocity(-1, 0));
+    BOOST_CHECK(f.peek() == EOF);
+}
+
+struct RecordingSink : FrameSink {
+    void frame(const Simulation& s, int index, bool eventful) {
+        frames.push_back(boost::make_tuple(s.t().t, index, eventful));
+    }
+    std::vector<boost::tuple<float, int, bool>> frames;
+};
+
+BOOST_AUTO_TEST_CASE(ScheduleFramesAtSeveralRates) {
+    auto m = boost::make_shared<Marble>("FOO", 1, 1, Position(1, 7), Velocity(4, 3));
+    Simulation s(18, 14, ba::list_of(m));
+    auto slow = boost::make_shared<RecordingSink>();
+    auto fast = boost::make_shared<RecordingSink>();
+    FramesScheduler scheduler;
+    scheduler.addSink(1, slow);
+    scheduler.addSink(2, fast);
+    scheduler.runUntil(s, Date(3));
+
+    BOOST_REQUIRE_EQUAL(slow->frames.size(), 4);
+    BOOST_REQUIRE_EQUAL(fast->frames.size(), 7);
+    BOOST_CHECK_EQUAL(fast->frames[3].get<0>(), 1.5);
+    BOOST_CHECK_EQUAL(fast->frames[3].get<1>(), 3);
+    // Wall collision at t=2 is applied just after frames dated 2
+    bool slowEventful[] = {true, false, false, true};
+    for(int i = 0; i != 4; ++i) {
+        BOOST_CHECK_EQUAL(slow->frames[i].get<0>(), i);
+        BOOST_CHECK_EQUAL(slow->frames[i].get<2>(), slowEventful[i]);
+    }
+    bool fastEventful[] = {true, false, false, false, false, true, false};
+    for(int i = 0; i != 7; ++i) {
+        BOOST_CHECK_EQUAL(fast->frames[i].get<2>(), fastEventful[i]);
+    }
+
+    scheduler.runUntil(s, Date(4));
+    BOOST_CHECK_EQUAL(slow->frames.size(), 5);
+    BOOST_CHECK_EQUAL(fast->frames.size(), 9);
+
+    BOOST_CHECK_THROW(scheduler.addSink(0, slow), std::invalid_argument);
+    BOOST_CHECK_THROW(scheduler.addSink(-25, slow), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE(ExportFramesAsDeltas) {
+    auto m1 = boost::make_shared<Marble>("1", 1, 1, Position(1, 5), Velocity(1, 0));
+    auto m2 = boost::make_shared<Marble>("2", 1, 1, Position(5, 2), Velocity(0, 0));
+    Simulation s(10, 10, ba::list_of(m1)(m2));
+    auto e = boost::make_shared<FramesExporter>("test_deltas.csv", TrajectoryWriter::Csv, true);
+    FramesScheduler scheduler;
+    scheduler.addSink(1, e);
+    scheduler.runUntil(s, Date(10));
+    e->close();
+
+    std::ifstream f("test_deltas.csv");
+    std::vector<std::string> lines;
+    for(std::string line; std::getline(f, line);) {
+        lines.push_back(line);
+    }
+    // Both marbles in the first frame, then only marble 0 after its collision with the wall at t=8
+    BOOST_REQUIRE_EQUAL(lines.size(), 4);
+    BOOST_CHECK_EQUAL(lines[1], "0,0,1,5,1,0");
+    BOOST_CHECK_EQUAL(lines[2], "1,0,5,2,0,0");
+    BOOST_CHECK_EQUAL(lines[3], "0,9,8,5,-1,0");
+}
+
+BOOST_AUTO_TEST_CASE(NextCollisionWithPeg) {
+    Peg p(Position(10, 0), 2);
+    BOOST_CHECK_EQUAL(p.nextCollisionDate(Date(1), Marble("1", 1, 1, Position(0, 0), Velocity(1, 0))), boost::optional<Date>(Date(7)));
+    BOOST_CHECK_EQUAL(p.nextCollisionDate(Date(1), Marble("1", 1, 1, Position(0, 0), Velocity(-1, 0))), boost::optional<Date>());
+    BOOST_CHECK_EQUAL(p.nextCollisionDate(Date(1), Marble("1", 1, 1, Position(0, 4), Velocity(1, 0))), boost::optional<Date>());
+    BOOST_CHECK_EQUAL(p.normal(Date(7), Marble("1", 1, 1, Position(0, 0), Velocity(1, 0))), Displacement(-1, 0));
+}
+
+BOOST_AUTO_TEST_CASE(NextCollisionWithSegment) {
+    Segment s(Position(10, -5), Position(10, 5));
+    // Inside
+    BOOST_CHECK_EQUAL(s.nextCollisionDate(Date(1), Marble("1", 1, 1, Position(0, 0), Velocity(1, 0))), boost::optional<Date>(Date(9)));
+    BOOST_CHECK_EQUAL(s.nextCollisionDate(Date(1), Marble("1", 1, 1, Position(20, 4), Velocity(-1, 0))), boost::optional<Date>(Date(9)));
+    BOOST_CHECK_EQUAL(s.normal(Date(9), Marble("1", 1, 1, Position(0, 0), Velocity(1, 0))), Displacement(-1, 0));
+    // End
+    BOOST_CHECK_EQUAL(s.nextCollisionDate(Date(1), Marble("1", 1, 1, Position(10, 10), Velocity(0, -1))), boost::optional<Date>(Date(4)));
+    BOOST_CHECK_EQUAL(s.normal(Date(4), Marble("1", 1, 1, Position(10, 10), Velocity(0, -1))), Displacement(0, 1));
+    // Miss
+    BOOST_CHECK_EQUAL(s.nextCollisionDate(Date(1), Marble("1", 1, 1, Position(0, 7), Velocity(1, 0))), boost::optional<Date>());
+    BOOST_CHECK_EQUAL(s.nextCollisionDate(Date(1), Marble("1", 1, 1, Position(0, 0), Velocity(0, 1))), boost::optional<Date>());
+}
+
+BOOST_AUTO_TEST_CASE(ObstaclesGridFindsSameCollisionsAsExhaustiveSearch) {
+    boost::random::mt19937 gen(42);
+    boost::random::uniform_real_distribution<float> x(0, 200);
+    boost::random::uniform_real_distribution<float> d(-10, 10);
+    std::vector<boost::shared_ptr<Obstacle>> obstacles;
+    for(int i = 0; i != 50; ++i) {
+        obstacles.push_back(boost::make_shared<Peg>(Position(x(gen), x(gen)), 2));
+        Position a(x(gen), x(gen));
+        obstacles.push_back(boost::make_shared<Segment>(a, a + Displacement(d(gen), d(gen))));
+    }
+    ObstaclesGrid grid(200, 200, 16, obstacles);
+    for(int i = 0; i != 200; ++i) {
+        Marble m("1", 1 + i % 20, 1, Position(x(gen), x(gen)), Velocity(d(gen), d(gen)));
+        boost::optional<Date> expected;
+        for(auto o: obstacles) {
+            boost::optional<Date> t = o->nextCollisionDate(Date(0), m);
+            if(t && *t < Date(100) && (!expected || *t < *expected)) {
+                expected = t;
+            }
+        }
+        auto actual = grid.nextCollision(Date(0), m, Date(100));
+        BOOST_CHECK_EQUAL(bool(actual), bool(expected));
+        if(actual && expected) {
+            BOOST_CHECK_EQUAL(actual->first, *expected);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ObstaclesGridFindsCollisionsWithLongSegments) {
+    boost::random::mt19937 gen(43);
+    // Segments may go out of the grid, marbles may not
+    boost::random::uniform_real_distribution<float> x(-20, 220);
+    boost::random::uniform_real_distribution<float> y(0, 200);
+    boost::random::uniform_real_distribution<float> d(-10, 10);
+    std::vector<boost::shared_ptr<Obstacle>> obstacles = ba::list_of<boost::shared_ptr<Obstacle>>
+        // Through corners of cells
+        (boost::make_shared<Segment>(Position(0, 0), Position(200, 200)))
+        (boost::make_shared<Segment>(Position(200, 0), Position(0, 200)))
+        (boost::make_shared<Segment>(Position(0, 48), Position(200, 48)));
+    for(int i = 0; i != 20; ++i) {
+        obstacles.push_back(boost::make_shared<Segment>(Position(x(gen), x(gen)), Position(x(gen), x(gen))));
+    }
+    ObstaclesGrid grid(200, 200, 16, obstacles);
+    for(int i = 0; i != 500; ++i) {
+        Marble m("1", 1 + i % 20, 1, Position(y(gen), y(gen)), Velocity(d(gen), d(gen)));
+        // Until the center leaves the grid, as walls would prevent it in a simulation
+        float tx = ((m.v().vx > 0 ? 200 : 0) - m.p(0).x) / m.v().vx;
+        float ty = ((m.v().vy > 0 ? 200 : 0) - m.p(0).y) / m.v().vy;
+        Date before(std::min(tx, ty));
+        boost::optional<Date> expected;
+        for(auto o: obstacles) {
+            boost::optional<Date> t = o->nextCollisionDate(Date(0), m);
+            if(t && *t < before && (!expected || *t < *expected)) {
+                expected = t;
+            }
+        }
+        auto actual = grid.nextCollision(Date(0), m, before);
+        BOOST_CHECK_EQUAL(bool(actual), bool(expected));
+        if(actual && expected) {
+            BOOST_CHECK_EQUAL(actual->first, *expected);
+        }
+    }
+
+    BOOST_CHECK_THROW(Segment(Position(1, 2), Position(1, 2)), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE(SimulateCollisionsWithObstacles) {
+    auto m = boost::make_shared<Marble>("1", 1, 1, Position(2, 5), Velocity(1, 0));
+    std::vector<boost::shared_ptr<Obstacle>> obstacles = ba::list_of<boost::shared_ptr<Obstacle>>
+        (boost::make_shared<Segment>(Position(8, 0), Position(8, 7)))
+        (boost::make_shared<Peg>(Position(50, 50), 3));
+    Simulation s(100, 100, ba::list_of(m), obstacles, 10);
+    BOOST_CHECK_EQUAL(s.obstacles().size(), 2);
+    s.runUntil(Date(5));
+    BOOST_CHECK_EQUAL(m->p(s.t()), Position(7, 5));
+    s.runUntil(Date(5.1));
+    BOOST_CHECK_EQUAL(m->v(), Velocity(-1, 0));
+}
+
+struct DriftAlarms : Simulation::Listener {
+    void driftExceeded(const Date& t, const Simulation::Stats&) {
+        dates.push_back(t);
+    }
+    std::vector<Date> dates;
+};
+
+BOOST_AUTO_TEST_CASE(MonitorConservation) {
+    auto m1 = boost::make_shared<Marble>("1", 1, 1, Position(1, 5), Velocity(1, 0));
+    auto m2 = boost::make_shared<Marble>("2", 1, 3, Position(4, 5.5), Velocity(0, 0));
+    auto m3 = boost::make_shared<Marble>("3", 2, 2, Position(9, 4), Velocity(-1, 0.5));
+    Simulation s(20, 10, ba::list_of(m1)(m2)(m3));
+    auto alarms = boost::make_shared<DriftAlarms>();
+    s.addListener(alarms);
+    s.setDriftAlarm(1e-4);
+    BOOST_CHECK_EQUAL(s.stats().energy, 1.75);
+    s.runUntil(Date(100));
+
+    Simulation::Stats stats = s.stats();
+    BOOST_CHECK_EQUAL(stats.appliedEvents, s.appliedEvents());
+    BOOST_CHECK_GT(stats.appliedEvents, 10);
+    double energy = 0;
+    for(auto m: s.marbles()) {
+        energy += m->m() * (double(m->v().vx) * m->v().vx + double(m->v().vy) * m->v().vy) / 2;
+    }
+    BOOST_CHECK_CLOSE(stats.energy, energy, 1e-9);
+    BOOST_CHECK_LT(stats.energyDrift, 1e-4);
+    BOOST_CHECK_LT(stats.momentumDrift, 1e-4);
+    BOOST_CHECK(alarms->dates.empty());
+
+    s.setDriftAlarm(-1);
+    s.runUntil(Date(200));
+    BOOST_CHECK_EQUAL(alarms->dates.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(RingBufferIsFifo) {
+    RingBuffer<int> b(2);
+    int i;
+    BOOST_CHECK(!b.pop(i));
+    BOOST_CHECK(b.push(1));
+    BOOST_CHECK(b.push(2));
+    BOOST_CHECK(!b.push(3));
+    BOOST_CHECK(b.pop(i));
+    BOOST_CHECK_EQUAL(i, 1);
+    BOOST_CHECK(b.push(4));
+    BOOST_CHECK(b.pop(i));
+    BOOST_CHECK_EQUAL(i, 2);
+    BOOST_CHECK(b.pop(i));
+    BOOST_CHECK_EQUAL(i, 4);
+    BOOST_CHECK(!b.pop(i));
+}
+
+BOOST_AUTO_TEST_CASE(GenerateCollisionsSound) {
+    auto m = boost::make_shared<Marble>("FOO", 1, 1, Position(1, 7), Velocity(4, 3));
+    Simulation s(18, 14, ba::list_of(m));
+    auto sound = boost::make_shared<CollisionsSound>("test_sound.wav", 8000);
+    s.addListener(sound);
+    s.runUntil(Date(3));
+    sound->close(Date(3));
+    sound->close(Date(4));
+    BOOST_CHECK_EQUAL(sound->droppedImpacts(), 0);
+
+    std::ifstream f("test_sound.wav", std::ios::binary);
+    std::vector<char> header(44);
+    f.read(&header[0], 44);
+    BOOST_CHECK_EQUAL(std::string(&header[0], 4), "RIFF");
+    BOOST_CHECK_EQUAL(std::string(&header[8], 8), "WAVEfmt ");
+    std::vector<std::int16_t> samples(24000);
+    f.read(reinterpret_cast<char*>(&samples[0]), 2 * samples.size());
+    BOOST_CHECK_EQUAL(f.gcount(), 48000);
+    BOOST_CHECK(f.peek() == EOF);
+    // Silence until the collision with the bottom wall at t=2
+    BOOST_CHECK_EQUAL(*std::max_element(samples.begin(), samples.begin() + 16000), 0);
+    BOOST_CHECK_GT(*std::max_element(samples.begin() + 16000, samples.begin() + 16100), 100);
+
+    BOOST_CHECK_THROW(CollisionsSound("no_such_directory/sound.wav"), std::runtime_error);
+    // Opening succeeds but every write fails
+    CollisionsSound full("/dev/full", 8000);
+    BOOST_CHECK_THROW(full.close(Date(1)), std::runtime_error);
+    full.close(Date(1));
+}
+
+BOOST_AUTO_TEST_CASE(NextCollisionBetweenMarblesWithinHorizon) {
+    Marble m1("1", 1, 1, Position(0, 0), Velocity(1, 0));
+    Marble m2("2", 2, 1, Position(9, 0), Velocity(-1, 0));
+    BOOST_CHECK_EQUAL(collisions::nextCollisionDate(Date(1), m1, m2, Duration(2)), boost::optional<Date>(Date(3)));
+    BOOST_CHECK_EQUAL(collisions::nextCollisionDate(Date(1), m1, m2, Duration(1.9)), boost::optional<Date>());
+    BOOST_CHECK_EQUAL(collisions::nextCollisionDate(Date(0), m1, m2, Duration(2.9)), boost::optional<Date>());
+}
+
+BOOST_AUTO_TEST_CASE(NextCollisionBetweenMarblesLateInSimulation) {
+    // Trajectories are extrapolated from the given date, not from t=0, where floats lack precision to compute this collision.
+    // (Extrapolating from t=0 gives t=100000.42)
+    Marble m1("1", 1, 1, Position(10, 20), Velocity(0, 0));
+    Marble m2("2", 1, 1, Position(12.1, 20), Velocity(0, 0));
+    m1.setVelocity(Date(100000), Velocity(3.3, 0));
+    m2.setVelocity(Date(100000), Velocity(-1.7, 0));
+    BOOST_CHECK_EQUAL(collisions::nextCollisionDate(Date(100000), m1, m2), boost::optional<Date>(Date(100000.02)));
+}
+
+BOOST_AUTO_TEST_CASE(SimulateChainOfFrontalCollisionWithHorizon) {
+    auto m1 = boost::make_shared<Marble>("1", 1, 1, Position(1, 5), Velocity(1, 0));
+    auto m2 = boost::make_shared<Marble>("2", 1, 1, Position(4, 5), Velocity(0, 0));
+    auto m3 = boost::make_shared<Marble>("3", 1, 1, Position(7, 5), Velocity(0, 0));
+    Simulation s(100, 10, ba::list_of(m1)(m2)(m3));
+    s.setHorizon(Duration(0.25));
+    s.runUntil(Date(1));
+    BOOST_CHECK_EQUAL(m1->v(), Velocity(1, 0));
+    BOOST_CHECK_EQUAL(m2->v(), Velocity(0, 0));
+    s.runUntil(Date(1.01));
+    BOOST_CHECK_EQUAL(m1->v(), Velocity(0, 0));
+    BOOST_CHECK_EQUAL(m2->v(), Velocity(1, 0));
+    BOOST_CHECK_EQUAL(m3->v(), Velocity(0, 0));
+    s.runUntil(Date(2.1));
+    BOOST_CHECK_EQUAL(m2->v(), Velocity(0, 0));
+    BOOST_CHECK_EQUAL(m3->v(), Velocity(1, 0));
+    // Checking the horizon is not counted as an event
+    BOOST_CHECK_EQUAL(s.appliedEvents(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(StreamPreviewSnapshots) {
+    auto m1 = boost::make_shared<Marble>("1", 2, 1, Position(10, 50), Velocity(10, 0));
+    auto m2 = boost::make_shared<Marble>("2", 4, 1, Position(90, 50), Velocity(-10, 0));
+    Simulation s(100, 80, ba::list_of(m1)(m2));
+    PreviewServer server("test_preview.sock", 0.5);
+    // No viewer yet
+    BOOST_CHECK(!server.send(s));
+
+    PreviewClient viewer("test_preview.sock");
+    s.runUntil(Date(2));
+    BOOST_CHECK(server.send(s));
+    Snapshot snapshot;
+    BOOST_REQUIRE(viewer.receive(snapshot, 1000));
+    BOOST_CHECK_EQUAL(snapshot.index, 1);
+    BOOST_CHECK_EQUAL(snapshot.t, 2);
+    BOOST_CHECK_EQUAL(snapshot.width, 50);
+    BOOST_CHECK_EQUAL(snapshot.height, 40);
+    BOOST_REQUIRE_EQUAL(snapshot.disks.size(), 2);
+    BOOST_CHECK_EQUAL(snapshot.disks[0].x, 15);
+    BOOST_CHECK_EQUAL(snapshot.disks[0].y, 25);
+    BOOST_CHECK_EQUAL(snapshot.disks[0].r, 1);
+    BOOST_CHECK_EQUAL(snapshot.disks[1].x, 35);
+    BOOST_CHECK_EQUAL(snapshot.disks[1].r, 2);
+    BOOST_CHECK(!viewer.receive(snapshot, 0));
+
+    // A viewer that doesn't keep up makes the server drop snapshots instead of waiting
+    int sent = 0;
+    while(server.send(s) && sent < 1000000) {
+        ++sent;
+    }
+    BOOST_CHECK_LT(sent, 1000000);
+    BOOST_CHECK_EQUAL(server.droppedSnapshots(), 2);
+    BOOST_REQUIRE(viewer.receive(snapshot, 1000));
+    BOOST_CHECK_EQUAL(snapshot.index, 2);
+}
+
+BOOST_AUTO_TEST_CASE(RunLive) {
+    auto m = boost::make_shared<Marble>("1", 1, 1, Position(2, 5), Velocity(1, 0));
+    Simulation s(10, 10, ba::list_of(m));
+    PreviewServer server("test_live.sock", 1);
+    // Ten times faster than real time
+    runLive(s, server, 10, 50, Date(2));
+    BOOST_CHECK_EQUAL(s.t(), Date(2));
+    BOOST_CHECK_EQUAL(m->p(s.t()), Position(4, 5));
+    BOOST_CHECK_GE(server.droppedSnapshots(), 2);
+    BOOST_CHECK_LE(server.droppedSnapshots(), 12);
+}
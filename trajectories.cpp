@@ -0,0 +1,199 @@
+#include "trajectories.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+
+namespace collide {
+
+AsyncWriter::AsyncWriter(const std::string& filename) :
+    _filename(filename),
+    _file(filename.c_str(), std::ios::binary | std::ios::trunc),
+    _chunks(),
+    _closing(false),
+    _failed(false),
+    _mutex(),
+    _condition(),
+    _thread()
+{
+    if(!_file) {
+        throw std::runtime_error("Unable to open " + _filename);
+    }
+    _thread = std::thread(&AsyncWriter::run, this);
+}
+
+AsyncWriter::~AsyncWriter() {
+    if(_thread.joinable()) {
+        try {
+            close();
+        } catch(const std::runtime_error&) {
+            // Can't report from a destructor: call close explicitly to get errors
+        }
+    }
+}
+
+void AsyncWriter::push(std::string chunk) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(_closing) {
+            throw std::logic_error("Writing to closed file " + _filename);
+        }
+        _chunks.push_back(std::string());
+        _chunks.back().swap(chunk);
+    }
+    _condition.notify_one();
+}
+
+void AsyncWriter::close() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closing = true;
+    }
+    _condition.notify_one();
+    if(_thread.joinable()) {
+        _thread.join();
+        if(_failed) {
+            throw std::runtime_error("Unable to write " + _filename);
+        }
+    }
+}
+
+void AsyncWriter::run() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while(true) {
+        _condition.wait(lock, [this]() {return _closing || !_chunks.empty();});
+        if(_chunks.empty()) {
+            break;
+        }
+        std::string chunk;
+        chunk.swap(_chunks.front());
+        _chunks.pop_front();
+        // Don't hold the lock while writing, so that push never waits for the disk
+        lock.unlock();
+        _file.write(chunk.data(), chunk.size());
+        lock.lock();
+    }
+    _file.close();
+    _failed = !_file;
+}
+
+
+TrajectoryWriter::TrajectoryWriter(const std::string& filename, Format format, std::size_t recordsPerChunk) :
+    _format(format),
+    _recordsPerChunk(recordsPerChunk),
+    _records(0),
+    _chunk(),
+    _closed(false),
+    _writer(filename)
+{
+    if(_format == Binary) {
+        _writer.push("MCTRAJ01");
+    } else {
+        _writer.push("marble,t,x,y,vx,vy\n");
+    }
+}
+
+TrajectoryWriter::~TrajectoryWriter() {
+    if(!_closed) {
+        try {
+            close();
+        } catch(const std::runtime_error&) {
+            // Can't report from a destructor: call close explicitly to get errors
+        }
+    }
+}
+
+void TrajectoryWriter::write(std::uint32_t marble, const Date& t, const Position& p, const Velocity& v) {
+    if(_closed) {
+        throw std::logic_error("Writing to closed trajectory file");
+    }
+    if(_format == Binary) {
+        if(_records == 0) {
+            // Room for the count of records, filled in flush
+            _chunk.append(sizeof(std::uint32_t), '\0');
+        }
+        const float values[] = {t.t, p.x, p.y, v.vx, v.vy};
+        _chunk.append(reinterpret_cast<const char*>(&marble), sizeof(marble));
+        _chunk.append(reinterpret_cast<const char*>(values), sizeof(values));
+    } else {
+        char line[128];
+        int length = std::snprintf(line, sizeof(line), "%u,%.9g,%.9g,%.9g,%.9g,%.9g\n", unsigned(marble), t.t, p.x, p.y, v.vx, v.vy);
+        _chunk.append(line, length);
+    }
+    if(++_records == _recordsPerChunk) {
+        flush();
+    }
+}
+
+void TrajectoryWriter::flush() {
+    if(_records != 0) {
+        if(_format == Binary) {
+            std::uint32_t records = _records;
+            std::memcpy(&_chunk[0], &records, sizeof(records));
+        }
+        _writer.push(std::move(_chunk));
+        _chunk.clear();
+        _records = 0;
+    }
+}
+
+void TrajectoryWriter::close() {
+    if(_closed) {
+        return;
+    }
+    _closed = true;
+    flush();
+    _writer.close();
+}
+
+
+SegmentsExporter::SegmentsExporter(const Simulation& s, const std::string& filename, TrajectoryWriter::Format format) :
+    _indexes(),
+    _writer(filename, format)
+{
+    for(std::uint32_t i = 0; i != s.marbles().size(); ++i) {
+        const Marble& m = *s.marbles()[i];
+        _indexes[&m] = i;
+        _writer.write(i, m.t0(), m.p(m.t0()), m.v());
+    }
+}
+
+void SegmentsExporter::trajectoryChanged(const Date& t, const Marble& m) {
+    _writer.write(_indexes[&m], t, m.p(t), m.v());
+}
+
+void SegmentsExporter::close() {
+    _writer.close();
+}
+
+
+FramesExporter::FramesExporter(const std::string& filename, TrajectoryWriter::Format format, bool deltas) :
+    _deltas(deltas),
+    _t0s(),
+    _writer(filename, format)
+{
+}
+
+void FramesExporter::sample(const Simulation& s) {
+    _t0s.resize(s.marbles().size(), -1);
+    for(std::uint32_t i = 0; i != s.marbles().size(); ++i) {
+        const Marble& m = *s.marbles()[i];
+        if(!_deltas || m.t0().t != _t0s[i]) {
+            _writer.write(i, s.t(), m.p(s.t()), m.v());
+            _t0s[i] = m.t0().t;
+        }
+    }
+}
+
+void FramesExporter::frame(const Simulation& s, int, bool eventful) {
+    if(eventful || !_deltas) {
+        sample(s);
+    }
+}
+
+void FramesExporter::close() {
+    _writer.close();
+}
+
+} // Namespace
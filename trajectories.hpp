@@ -0,0 +1,101 @@
+#ifndef trajectories_hpp
+#define trajectories_hpp
+
+#include <cstdint>
+#include <string>
+#include <deque>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+
+#include "collide.hpp"
+
+
+namespace collide {
+
+// Writes chunks to a file on a background thread, so that the simulation never waits for the disk.
+// Errors while writing are reported by close.
+class AsyncWriter {
+public:
+    AsyncWriter(const std::string& filename);
+    ~AsyncWriter();
+
+    void push(std::string chunk);
+    void close();
+
+private:
+    void run();
+
+private:
+    std::string _filename;
+    std::ofstream _file;
+    std::deque<std::string> _chunks;
+    bool _closing;
+    bool _failed;
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    std::thread _thread;
+};
+
+// Records are the state (position and velocity) of a marble at a given date.
+// Binary format: the 8 bytes "MCTRAJ01", then chunks made of a uint32 count of records
+// followed by that many records (uint32 marble, float t, float x, float y, float vx, float vy) in native byte order.
+// Csv format: a header line "marble,t,x,y,vx,vy" then one line per record.
+class TrajectoryWriter {
+public:
+    enum Format {Binary, Csv};
+
+    TrajectoryWriter(const std::string& filename, Format, std::size_t recordsPerChunk = 4096);
+    ~TrajectoryWriter();
+
+    void write(std::uint32_t marble, const Date&, const Position&, const Velocity&);
+    void close();
+
+private:
+    void flush();
+
+private:
+    Format _format;
+    std::size_t _recordsPerChunk;
+    std::size_t _records;
+    std::string _chunk;
+    bool _closed;
+    AsyncWriter _writer;
+};
+
+// Exports trajectories as piecewise-linear segments: one record each time the velocity of a marble changes.
+// Much smaller than sampling each frame, because trajectories are linear between events.
+class SegmentsExporter : public Simulation::Listener {
+public:
+    SegmentsExporter(const Simulation&, const std::string& filename, TrajectoryWriter::Format);
+
+    void trajectoryChanged(const Date&, const Marble&);
+    void close();
+
+private:
+    std::unordered_map<const Marble*, std::uint32_t> _indexes;
+    TrajectoryWriter _writer;
+};
+
+// Exports the state of all marbles each time it's sampled.
+// With deltas, frames only contain the marbles whose trajectory changed since the previous frame
+// (and frames without events are not written at all): the others are extrapolated from their last record.
+class FramesExporter : public FrameSink {
+public:
+    FramesExporter(const std::string& filename, TrajectoryWriter::Format, bool deltas = false);
+
+    void sample(const Simulation&);
+    void frame(const Simulation&, int index, bool eventful);
+    void close();
+
+private:
+    bool _deltas;
+    std::vector<float> _t0s;
+    TrajectoryWriter _writer;
+};
+
+} // Namespace
+
+#endif // Include guard
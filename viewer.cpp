@@ -0,0 +1,40 @@
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+
+#include "preview.hpp"
+
+using namespace collide;
+
+
+// Displays the snapshots streamed by "collide live" in the terminal
+int main(int argc, char* argv[]) {
+    std::string path = argc > 1 ? argv[1] : "collide.sock";
+    int columns = argc > 2 ? boost::lexical_cast<int>(argv[2]) : 80;
+    PreviewClient client(path);
+    Snapshot snapshot;
+    std::string screen;
+    while(client.receive(snapshot, 5000)) {
+        // Characters are about twice as high as wide
+        int rows = std::max(1, columns * snapshot.height / std::max(1, 2 * snapshot.width));
+        float sx = float(columns) / std::max(1, int(snapshot.width));
+        float sy = float(rows) / std::max(1, int(snapshot.height));
+        std::vector<std::string> lines(rows, std::string(columns, ' '));
+        for(const Snapshot::Disk& d: snapshot.disks) {
+            int x = d.x * sx;
+            int y = d.y * sy;
+            if(x >= 0 && x < columns && y >= 0 && y < rows) {
+                lines[y][x] = d.r * sx >= 1 ? 'O' : 'o';
+            }
+        }
+        screen = "\033[H\033[2J";
+        for(const std::string& line: lines) {
+            screen += line + "\n";
+        }
+        screen += "t=" + boost::lexical_cast<std::string>(snapshot.t) + " snapshot " + boost::lexical_cast<std::string>(snapshot.index) + "\n";
+        std::cout << screen << std::flush;
+    }
+}